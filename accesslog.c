@@ -0,0 +1,259 @@
+#include "accesslog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define ACCESS_LOG_BUFFER_SIZE (64*1024) //stdio buffer of the log file
+
+static _Atomic unsigned long next_log_id = 1;   //ids of the access logs (0 is no log)
+static __thread unsigned long my_ring_log = 0;  //id of the log my_ring belongs to
+static __thread access_ring_t* my_ring = NULL;  //ring of the calling worker thread
+static __thread int my_ring_failed = 0;         //1 if the thread could not get a ring
+
+//the next function gets an access log and opens it's file for append, (used in create and rotate).
+//returns 0 on success and -1 on failure.
+static int open_log_file(access_log* log);
+
+//the next function gets a record and writes it as one line to the log file.
+static void write_record(access_log* log, const access_record_t* record);
+
+//the next function renames the log file to "<path>.1" and opens a new one, if it is too big.
+static void rotate_if_needed(access_log* log);
+
+
+access_log* create_access_log(const char* path)
+{
+    if(path == NULL) //case of invalid argument.
+    {
+        printf("invalid access log path");
+        return NULL;
+    }
+    access_log* log = (access_log*)calloc(1,sizeof(access_log));
+    if(log == NULL)
+    {
+        perror("MALLOC FAILED");
+        return NULL;
+    }
+    log->path = strdup(path);
+    if(log->path == NULL)
+    {
+        perror("MALLOC FAILED");
+        free(log);
+        return NULL;
+    }
+    //INIT ACCESS LOG:
+    log->id = atomic_fetch_add(&next_log_id,1);   //a new id even if the memory of a destroyed log is reused.
+    for(int i = 0; i < ACCESS_LOG_MAX_RINGS ; i++)
+        atomic_init(&(log->rings[i]),NULL);
+    atomic_init(&(log->num_rings),0);
+    atomic_init(&(log->dropped),0);
+    atomic_init(&(log->shutdown),0);
+    log->dropped_logged = 0;
+    if(open_log_file(log) < 0)
+    {
+        free(log->path);
+        free(log);
+        return NULL;
+    }
+    //CREATING THE DRAIN THREAD:
+    if(pthread_create(&(log->drainer),NULL,access_log_drain,log) != 0)
+    {
+        perror("pthread_create");
+        fclose(log->file);
+        free(log->path);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+void access_log_push(access_log* log, const access_record_t* record)
+{
+    if(log == NULL || record == NULL) //case of invalid argument
+        return;
+    if(my_ring_log != log->id)  //first push of this thread to this log, forget the ring of the old one.
+    {
+        my_ring_log = log->id;
+        my_ring = NULL;
+        my_ring_failed = 0;
+    }
+    if(my_ring == NULL && !my_ring_failed) //first push of this thread, register a ring.
+    {
+        int index = atomic_fetch_add(&(log->num_rings),1);
+        if(index < ACCESS_LOG_MAX_RINGS)
+            my_ring = (access_ring_t*)calloc(1,sizeof(access_ring_t));
+        if(my_ring == NULL)
+            my_ring_failed = 1;
+        else
+            atomic_store_explicit(&(log->rings[index]),my_ring,memory_order_release);
+    }
+    if(my_ring == NULL) //case there is no ring for this thread.
+    {
+        atomic_fetch_add_explicit(&(log->dropped),1,memory_order_relaxed);
+        return;
+    }
+    unsigned int head = atomic_load_explicit(&(my_ring->head),memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&(my_ring->tail),memory_order_acquire);
+    if(head - tail >= ACCESS_LOG_RING_SIZE) //case the ring is full, drop the record.
+    {
+        atomic_fetch_add_explicit(&(log->dropped),1,memory_order_relaxed);
+        return;
+    }
+    my_ring->records[head & (ACCESS_LOG_RING_SIZE-1)] = *record;
+    atomic_store_explicit(&(my_ring->head),head+1,memory_order_release); //publish the record.
+}
+
+void* access_log_drain(void* p)
+{
+    if(p == NULL)   //case of invalid argument
+    {
+        printf("invalid argument");
+        return NULL;
+    }
+    access_log* log = (access_log*)p;
+    while(1)
+    {
+        //read shutdown before draining, so records pushed before destroy are never lost.
+        int shutdown = atomic_load_explicit(&(log->shutdown),memory_order_acquire);
+        int drained = 0;
+        int reopened = 0;   //reopen the file at most once a batch.
+        int num_rings = atomic_load_explicit(&(log->num_rings),memory_order_acquire);
+        if(num_rings > ACCESS_LOG_MAX_RINGS)
+            num_rings = ACCESS_LOG_MAX_RINGS;
+        for(int i = 0; i < num_rings ; i++) //drain every registered ring.
+        {
+            access_ring_t* ring = atomic_load_explicit(&(log->rings[i]),memory_order_acquire);
+            if(ring == NULL) //case the ring is not published yet.
+                continue;
+            unsigned int tail = atomic_load_explicit(&(ring->tail),memory_order_relaxed);
+            unsigned int head = atomic_load_explicit(&(ring->head),memory_order_acquire);
+            if(tail != head && log->file == NULL && !reopened) //case a rotation could not reopen the file.
+            {
+                reopened = 1;
+                open_log_file(log);
+            }
+            while(tail != head)
+            {
+                write_record(log,&(ring->records[tail & (ACCESS_LOG_RING_SIZE-1)]));
+                tail++;
+                drained++;
+            }
+            atomic_store_explicit(&(ring->tail),tail,memory_order_release); //free the slots.
+        }
+        unsigned long dropped = atomic_load_explicit(&(log->dropped),memory_order_relaxed);
+        if(dropped != log->dropped_logged && log->file != NULL) //report records dropped since the last batch.
+        {
+            int rc = fprintf(log->file,"# dropped %lu records (total %lu)\n",
+                dropped - log->dropped_logged,dropped);
+            if(rc > 0)
+                log->file_size += rc;
+            log->dropped_logged = dropped;
+            drained++;
+        }
+        if(drained > 0 && log->file != NULL) //write the batch and rotate.
+        {
+            fflush(log->file);
+            rotate_if_needed(log);
+        }
+        if(shutdown)
+            return NULL;
+        if(drained == 0)    //all the rings are empty, wait for work.
+            usleep(ACCESS_LOG_IDLE_USEC);
+    }
+}
+
+void destroy_access_log(access_log* log)
+{
+    if(log == NULL)   //case of invalid argument
+    {
+        printf("invalid argument");
+        return;
+    }
+    atomic_store_explicit(&(log->shutdown),1,memory_order_release); //alert the drain thread to finish.
+    void* retval;
+    pthread_join(log->drainer,&retval);
+    //DEALLOCATING ACCESS LOG:
+    for(int i = 0; i < ACCESS_LOG_MAX_RINGS ; i++)
+        free(atomic_load(&(log->rings[i])));
+    if(log->file != NULL)
+        fclose(log->file);
+    free(log->path);
+    free(log);
+}
+
+int64_t access_log_now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock,&ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int open_log_file(access_log* log)
+{
+    log->file = fopen(log->path,"a");
+    if(log->file == NULL)
+    {
+        perror("FAILED OPEN ACCESS LOG");
+        return -1;
+    }
+    setvbuf(log->file,NULL,_IOFBF,ACCESS_LOG_BUFFER_SIZE); //buffer whole batches.
+    fseek(log->file,0,SEEK_END);
+    log->file_size = ftell(log->file);
+    if(log->file_size < 0)
+        log->file_size = 0;
+    return 0;
+}
+
+static void write_record(access_log* log, const access_record_t* record)
+{
+    if(log->file == NULL)   //case the file could not be reopened after rotation, count the record.
+    {
+        atomic_fetch_add_explicit(&(log->dropped),1,memory_order_relaxed);
+        return;
+    }
+    char time_str[32];
+    char ip_str[INET_ADDRSTRLEN];
+    time_t sec = (time_t)(record->timestamp_usec/1000000);
+    struct tm tm;
+    gmtime_r(&sec,&tm);
+    strftime(time_str,sizeof(time_str),"%Y-%m-%dT%H:%M:%S",&tm);
+    struct in_addr addr;
+    addr.s_addr = record->client_ip;
+    if(inet_ntop(AF_INET,&addr,ip_str,sizeof(ip_str)) == NULL)
+        strcpy(ip_str,"-");
+    //<time> <client> <host> "<path>" <status> <bytes> <phase durations in usec>
+    int rc = fprintf(log->file,"%s.%06ldZ %s %s \"%s\" %d %llu queue=%lld read=%lld parse=%lld connect=%lld relay=%lld total=%lld\n",
+        time_str,(long)(record->timestamp_usec%1000000),ip_str,
+        record->host[0] ? record->host : "-",record->path[0] ? record->path : "-",
+        record->status,(unsigned long long)record->bytes,
+        (long long)record->queue_usec,(long long)record->read_usec,(long long)record->parse_usec,
+        (long long)record->connect_usec,(long long)record->relay_usec,
+        (long long)record->total_usec);
+    if(rc > 0)
+        log->file_size += rc;
+}
+
+static void rotate_if_needed(access_log* log)
+{
+    if(log->file_size < ACCESS_LOG_MAX_BYTES)
+        return;
+    fclose(log->file);
+    log->file = NULL;
+    char* rotated = (char*)calloc(strlen(log->path)+3,sizeof(char));
+    if(rotated == NULL)
+    {
+        perror("MALLOC FAILED");
+    }
+    else
+    {
+        strcpy(rotated,log->path);
+        strcat(rotated,".1");
+        if(rename(log->path,rotated) < 0)
+            perror("rename");
+        free(rotated);
+    }
+    open_log_file(log); //on failure file stays NULL, the next batch tries again.
+}
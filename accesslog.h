@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * accesslog.h
+ *
+ * This file declares the access log of the proxy server.
+ * workers push fixed-size records into their own ring buffer (one
+ * producer, one consumer), and a background thread drains all the
+ * rings to the log file, so logging never blocks the request path.
+ */
+
+// maximum number of rings (one per worker thread, at least MAXT_IN_POOL, checked in proxyServer.c)
+#define ACCESS_LOG_MAX_RINGS 200
+// number of records in each ring (must be a power of 2)
+#define ACCESS_LOG_RING_SIZE 256
+// size of the log file before it is rotated to "<path>.1" (lowered by the tests)
+#ifndef ACCESS_LOG_MAX_BYTES
+#define ACCESS_LOG_MAX_BYTES (10*1024*1024)
+#endif
+// how long the drain thread sleeps when all the rings are empty
+#define ACCESS_LOG_IDLE_USEC 50000
+
+#define ACCESS_LOG_HOST_LEN 64
+#define ACCESS_LOG_PATH_LEN 128
+
+
+/**
+ * a single access log record, filled by the worker and copied into its ring.
+ * all durations are in microseconds.
+ */
+typedef struct access_record_st{
+      int64_t timestamp_usec;    //wall clock time the request was accepted
+      uint32_t client_ip;        //client ipv4 address (network byte order)
+      int status;                //status code sent to the client (0 if unknown)
+      uint64_t bytes;            //bytes sent to the client
+      int64_t queue_usec;        //waiting in the threadpool queue for a worker
+      int64_t read_usec;         //reading the request from the client
+      int64_t parse_usec;        //parsing the request (parse_request)
+      int64_t connect_usec;      //resolving and connecting the server (connect_server)
+      int64_t relay_usec;        //relaying the response to the client
+      int64_t total_usec;        //whole request, from accept to close
+      char host[ACCESS_LOG_HOST_LEN];  //requested host ("-" if unknown)
+      char path[ACCESS_LOG_PATH_LEN];  //requested path ("-" if unknown)
+} access_record_t;
+
+
+/**
+ * single producer single consumer ring of records.
+ * head is written only by the worker, tail only by the drain thread.
+ */
+typedef struct access_ring_st{
+      _Atomic unsigned int head;   //next slot to write
+      _Atomic unsigned int tail;   //next slot to read
+      access_record_t records[ACCESS_LOG_RING_SIZE];
+} access_ring_t;
+
+
+/**
+ * The actual access log
+ */
+typedef struct _access_log_st {
+      unsigned long id;            //unique id, the rings of the threads are tied to it
+      char* path;                  //path of the log file
+      FILE* file;                  //the open log file
+      long file_size;              //bytes written to the current file
+      pthread_t drainer;           //the background drain thread
+      _Atomic(access_ring_t*) rings[ACCESS_LOG_MAX_RINGS];  //registered rings
+      _Atomic int num_rings;       //number of rings handed out
+      _Atomic unsigned long dropped;  //records dropped because a ring was full or the file was not open
+      unsigned long dropped_logged;   //dropped count already written to the file
+      _Atomic int shutdown;        //1 if the log is in distruction process
+} access_log;
+
+
+/**
+ * create_access_log opens (appends to) the log file at "path" and starts
+ * the drain thread. If the function succeeds, it returns a (non-NULL)
+ * "access_log", else it returns NULL.
+ */
+access_log* create_access_log(const char* path);
+
+/**
+ * access_log_push copies "record" into the ring of the calling thread.
+ * the ring is allocated the first time a thread pushes to "log" (a thread
+ * which pushes to another log gets a new ring there).
+ * if the ring is full (or no ring is left) the record is dropped and counted,
+ * this function never blocks.
+ */
+void access_log_push(access_log* log, const access_record_t* record);
+
+/**
+ * The work function of the drain thread
+ * this function should:
+ * 1. drain every registered ring to the file (reopen it first if a rotation
+ *    could not, records are dropped and counted while it stays closed)
+ * 2. flush the batch and rotate the file if it is too big
+ * 3. if nothing was drained, sleep
+ * 4. on shutdown, drain one last time and return
+ */
+void* access_log_drain(void* p);
+
+/**
+ * destroy_access_log stops the drain thread after it wrote every
+ * pending record, closes the file and frees all the memory
+ * associated with the access log.
+ */
+void destroy_access_log(access_log* log);
+
+/**
+ * access_log_now returns the current time of "clock" in microseconds.
+ */
+int64_t access_log_now(clockid_t clock);
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * loadgen.c
+ *
+ * a local load generator for the proxy, used by "make bench" and as the
+ * training load of "make pgo-generate".
+ * it starts it's own origin server on a free local port (or on <origin-port>),
+ * then <concurrency> clients send <requests> requests in total through the
+ * proxy to that origin, and it prints the throughput and the latency percentiles.
+ * with <host> the requests are sent to that virtual host instead of the origin
+ * address, so an upstream group of the proxy can point at <origin-port>.
+ *
+ * Usage: loadgen <proxy-port> <concurrency> <requests> [<origin-port> [<host>]]
+ */
+
+#define ORIGIN_THREADS 8
+#define RESPONSE_BODY_SIZE 1024
+
+//---------------------------Structures-----------------------------------//
+//the next structure holds the data of a client thread.
+typedef struct client_data{
+    int num_requests;   //requests to send
+    int64_t* latencies; //latency of each request (usec)
+    int errors;         //requests without a 200 response
+} client_data_t;
+
+//---------------------------GLOBAL VARIABLES-----------------------------//
+int proxy_port;
+int origin_port;
+char* host;     //the Host of the requests, NULL for the origin address
+char* response; //the response of the origin
+int response_len;
+
+//the next function returns the monotonic time in microseconds.
+static int64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//the next function is an origin thread, it answers every connection with the same response.
+static void* origin(void* arg)
+{
+    int welcome_sd = *(int*)arg;
+    char buffer[1024];
+    while(1)
+    {
+        int sd = accept(welcome_sd,NULL,NULL);
+        if(sd < 0)
+            continue;
+        int size = 0;
+        while(size < (int)sizeof(buffer)-1)    //read the request until "\r\n\r\n".
+        {
+            int rc = read(sd,buffer+size,sizeof(buffer)-1-size);
+            if(rc <= 0)
+                break;
+            size += rc;
+            buffer[size] = '\0';
+            if(strstr(buffer,"\r\n\r\n") != NULL)
+                break;
+        }
+        write(sd,response,response_len);
+        close(sd);
+    }
+    return NULL;
+}
+
+//the next function connects the proxy, retrying while it is not listening yet.
+static int connect_proxy(void)
+{
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(proxy_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int tries = 0 ; tries < 500 ; tries++)
+    {
+        int sd = socket(AF_INET,SOCK_STREAM,0);
+        if(sd < 0)
+            return -1;
+        if(connect(sd,(struct sockaddr*)&addr,sizeof(addr)) == 0)
+            return sd;
+        close(sd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+//the next function is a client thread, it sends it's requests one after the other.
+static void* client(void* arg)
+{
+    client_data_t* client_data = (client_data_t*)arg;
+    char request[128];
+    if(host != NULL)
+        snprintf(request,sizeof(request),"GET / HTTP/1.0\r\nHost: %s\r\n\r\n",host);
+    else
+        snprintf(request,sizeof(request),"GET / HTTP/1.0\r\nHost: 127.0.0.1:%d\r\n\r\n",origin_port);
+    char buffer[4096];
+    for(int i = 0 ; i < client_data->num_requests ; i++)
+    {
+        int64_t start = now_usec();
+        int sd = connect_proxy();
+        if(sd < 0)
+        {
+            perror("connect");
+            exit(1);
+        }
+        write(sd,request,strlen(request));
+        int size = 0;
+        int ok = 0;
+        while(1)    //read the whole response.
+        {
+            int rc = read(sd,buffer,sizeof(buffer));
+            if(rc <= 0)
+                break;
+            if(size == 0 && rc >= 12 && strncmp(buffer,"HTTP/1.0 200",12) == 0)
+                ok = 1;
+            size += rc;
+        }
+        close(sd);
+        client_data->latencies[i] = now_usec() - start;
+        if(!ok || size != response_len)
+            client_data->errors++;
+    }
+    return NULL;
+}
+
+static int compare(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 4 || argc > 6 || atoi(argv[1]) <= 0 || atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0
+        || (argc >= 5 && atoi(argv[4]) <= 0))
+    {
+        printf("Usage: loadgen <proxy-port> <concurrency> <requests> [<origin-port> [<host>]]\n");
+        return 1;
+    }
+    proxy_port = atoi(argv[1]);
+    int concurrency = atoi(argv[2]);
+    int num_requests = atoi(argv[3]);
+    host = argc == 6 ? argv[5] : NULL;
+    if(concurrency > num_requests)
+        concurrency = num_requests;
+    //INIT ORIGIN RESPONSE:
+    response = (char*)malloc(RESPONSE_BODY_SIZE+128);
+    if(response == NULL)
+    {
+        perror("MALLOC FAILED");
+        return 1;
+    }
+    response_len = sprintf(response,"HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n",RESPONSE_BODY_SIZE);
+    memset(response+response_len,'x',RESPONSE_BODY_SIZE);
+    response_len += RESPONSE_BODY_SIZE;
+    //START ORIGIN ON <origin-port> OR A FREE PORT:
+    int welcome_sd = socket(AF_INET,SOCK_STREAM,0);
+    int reuse = 1;
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(argc >= 5 ? atoi(argv[4]) : 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if(welcome_sd < 0 || setsockopt(welcome_sd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse)) < 0 || bind(welcome_sd,(struct sockaddr*)&addr,sizeof(addr)) < 0 || listen(welcome_sd,SOMAXCONN) < 0
+        || getsockname(welcome_sd,(struct sockaddr*)&addr,&addr_len) < 0)
+    {
+        perror("origin");
+        return 1;
+    }
+    origin_port = ntohs(addr.sin_port);
+    pthread_t thread;
+    for(int i = 0 ; i < ORIGIN_THREADS ; i++)
+        pthread_create(&thread,NULL,origin,&welcome_sd);
+    //RUN THE CLIENTS:
+    int64_t* latencies = (int64_t*)calloc(num_requests,sizeof(int64_t));
+    client_data_t* clients = (client_data_t*)calloc(concurrency,sizeof(client_data_t));
+    pthread_t* threads = (pthread_t*)calloc(concurrency,sizeof(pthread_t));
+    if(latencies == NULL || clients == NULL || threads == NULL)
+    {
+        perror("MALLOC FAILED");
+        return 1;
+    }
+    int64_t start = now_usec();
+    int offset = 0;
+    for(int i = 0 ; i < concurrency ; i++)  //spread the requests between the clients.
+    {
+        clients[i].num_requests = num_requests/concurrency + (i < num_requests%concurrency ? 1 : 0);
+        clients[i].latencies = latencies + offset;
+        offset += clients[i].num_requests;
+        pthread_create(&threads[i],NULL,client,&clients[i]);
+    }
+    int errors = 0;
+    for(int i = 0 ; i < concurrency ; i++)
+    {
+        pthread_join(threads[i],NULL);
+        errors += clients[i].errors;
+    }
+    int64_t elapsed = now_usec() - start;
+    //REPORT:
+    qsort(latencies,num_requests,sizeof(int64_t),compare);
+    printf("requests: %d  concurrency: %d  errors: %d\n",num_requests,concurrency,errors);
+    printf("time: %.3f s  throughput: %.0f req/s\n",elapsed/1e6,num_requests/(elapsed/1e6));
+    printf("latency usec: p50 %lld  p90 %lld  p99 %lld  max %lld\n",
+        (long long)latencies[num_requests/2],(long long)latencies[num_requests*9/10],
+        (long long)latencies[num_requests*99/100],(long long)latencies[num_requests-1]);
+    free(latencies);
+    free(clients);
+    free(threads);
+    return errors == 0 ? 0 : 1;
+}
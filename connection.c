@@ -0,0 +1,165 @@
+#include "connection.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+//the next function allocates a new connection with an initial buffer, NULL on failure.
+static connection_t* new_connection(connection_pool* pool);
+
+
+connection_pool* create_connection_pool(int num_connections)
+{
+    if(num_connections < 0) //case of invalid argument.
+    {
+        printf("invalid num connections in pool");
+        return NULL;
+    }
+    connection_pool* pool = (connection_pool*)malloc(sizeof(connection_pool));
+    if(pool == NULL)
+    {
+        perror("MALLOC FAILED");
+        return NULL;
+    }
+    //INIT POOL:
+    pool->free_list = NULL;
+    pool->num_free = 0;
+    pool->num_allocated = 0;
+    pthread_mutex_init(&(pool->lock), NULL);
+    //ALLOCATING THE CONNECTIONS:
+    for(int i = 0; i < num_connections ; i++)
+    {
+        connection_t* conn = new_connection(pool);
+        if(conn == NULL)
+        {
+            destroy_connection_pool(pool);
+            return NULL;
+        }
+        conn->next = pool->free_list;
+        pool->free_list = conn;
+        (pool->num_free)++;
+    }
+    return pool;
+}
+
+connection_t* acquire_connection(connection_pool* pool)
+{
+    if(pool == NULL) //case of invalid argument
+        return NULL;
+    pthread_mutex_lock(&(pool->lock));
+    connection_t* conn = pool->free_list;
+    if(conn != NULL)    //case there is a free connection, take it.
+    {
+        pool->free_list = conn->next;
+        (pool->num_free)--;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    if(conn == NULL)    //case the pool is empty, allocate a new one (outside the lock).
+    {
+        conn = new_connection(pool);
+        if(conn == NULL)
+            return NULL;
+    }
+    //RESET CONNECTION:
+    conn->fd = -1;
+    memset(&(conn->client_addr),0,sizeof(conn->client_addr));
+    conn->accept_usec = 0;
+    conn->accept_wall_usec = 0;
+    conn->size = 0;
+    conn->buffer[0] = '\0';
+    conn->next = NULL;
+    return conn;
+}
+
+int connection_reserve(connection_t* conn, int size)
+{
+    if(conn->size + size + 1 <= conn->capacity) //case there is enough space.
+        return 0;
+    int capacity = conn->capacity;
+    while(conn->size + size + 1 > capacity)
+        capacity *= 2;
+    char* buffer = (char*)realloc(conn->buffer,capacity*sizeof(char));
+    if(buffer == NULL)
+    {
+        perror("MALLOC FAILED");
+        return -1;
+    }
+    conn->buffer = buffer;
+    conn->capacity = capacity;
+    return 0;
+}
+
+void release_connection(connection_t* conn)
+{
+    if(conn == NULL)   //case of invalid argument
+        return;
+    if(conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if(conn->capacity > CONNECTION_BUFFER_MAX)  //don't keep huge buffers in the pool.
+    {
+        char* buffer = (char*)realloc(conn->buffer,CONNECTION_BUFFER_SIZE*sizeof(char));
+        if(buffer != NULL)
+        {
+            conn->buffer = buffer;
+            conn->capacity = CONNECTION_BUFFER_SIZE;
+        }
+    }
+    connection_pool* pool = conn->pool;
+    pthread_mutex_lock(&(pool->lock));
+    conn->next = pool->free_list;
+    pool->free_list = conn;
+    (pool->num_free)++;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+void destroy_connection_pool(connection_pool* pool)
+{
+    if(pool == NULL)   //case of invalid argument
+    {
+        printf("invalid argument");
+        return;
+    }
+    pthread_mutex_lock(&(pool->lock));
+    if(pool->num_free != pool->num_allocated)   //case a worker still owns a connection.
+        printf("connection pool destroyed with %d connections in use\n",pool->num_allocated - pool->num_free);
+    //DEALLOCATING CONNECTIONS:
+    connection_t* conn = pool->free_list;
+    while(conn != NULL)
+    {
+        connection_t* next = conn->next;
+        free(conn->buffer);
+        free(conn);
+        conn = next;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool);
+}
+
+static connection_t* new_connection(connection_pool* pool)
+{
+    connection_t* conn = (connection_t*)calloc(1,sizeof(connection_t));
+    if(conn == NULL)
+    {
+        perror("MALLOC FAILED");
+        return NULL;
+    }
+    conn->buffer = (char*)calloc(CONNECTION_BUFFER_SIZE,sizeof(char));
+    if(conn->buffer == NULL)
+    {
+        perror("MALLOC FAILED");
+        free(conn);
+        return NULL;
+    }
+    conn->capacity = CONNECTION_BUFFER_SIZE;
+    conn->fd = -1;
+    conn->pool = pool;
+    pthread_mutex_lock(&(pool->lock));
+    (pool->num_allocated)++;
+    pthread_mutex_unlock(&(pool->lock));
+    return conn;
+}
@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * connection.h
+ *
+ * This file declares the per-connection context which the accept loop
+ * hands to the worker threads, and the pool it is recycled in.
+ * the accept loop acquires a context, fills it and dispatches it,
+ * from that moment the worker owns it until it releases it back to the pool.
+ */
+
+// initial size of the request buffer of a connection
+#define CONNECTION_BUFFER_SIZE 1024
+// buffers bigger than this are shrunk back when the connection is released
+#define CONNECTION_BUFFER_MAX (64*1024)
+
+
+/**
+ * the context of a single accepted connection
+ */
+typedef struct connection_st{
+      int fd;                          //client socket fd (-1 if closed)
+      struct sockaddr_in client_addr;  //client address, filled by accept
+      int64_t accept_usec;             //monotonic time the connection was accepted
+      int64_t accept_wall_usec;        //wall clock time the connection was accepted
+      char* buffer;                    //buffer to read the request into (kept between connections)
+      int capacity;                    //allocated size of buffer
+      int size;                        //bytes in buffer
+      struct _connection_pool_st* pool;   //the pool to release to
+      struct connection_st* next;      //next free connection
+} connection_t;
+
+
+/**
+ * The actual pool
+ */
+typedef struct _connection_pool_st {
+      connection_t* free_list;    //free connections head pointer
+      int num_free;               //number of free connections
+      int num_allocated;          //number of connections allocated in total
+      pthread_mutex_t lock;       //lock on the free list
+} connection_pool;
+
+
+/**
+ * create_connection_pool creates a pool with "num_connections"
+ * free connections already allocated. If the function succeeds,
+ * it returns a (non-NULL) "connection_pool", else it returns NULL.
+ */
+connection_pool* create_connection_pool(int num_connections);
+
+/**
+ * acquire_connection takes a free connection from the pool, or allocates
+ * a new one if there is none, and resets it's fields.
+ * it returns NULL if the allocation failed.
+ */
+connection_t* acquire_connection(connection_pool* pool);
+
+/**
+ * connection_reserve makes sure the buffer of "conn" can hold "size" more bytes
+ * (and a terminating '\0'). it returns 0 on success and -1 if the allocation failed.
+ */
+int connection_reserve(connection_t* conn, int size);
+
+/**
+ * release_connection closes the fd of "conn" (if it is still open)
+ * and returns it to the pool it was acquired from.
+ */
+void release_connection(connection_t* conn);
+
+/**
+ * destroy_connection_pool frees all the memory associated with the pool.
+ * every connection must have been released before.
+ */
+void destroy_connection_pool(connection_pool* pool);
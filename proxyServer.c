@@ -1,4 +1,7 @@
 #include "threadpool.h"
+#include "accesslog.h"
+#include "connection.h"
+#include "upstream.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,7 +10,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/time.h>
 #include <errno.h>
 
 //---------------------------Forward Declarations-------------------------//
@@ -20,6 +25,8 @@ typedef struct proxy_data{
     unsigned int num_request;
     char** filter;  //array of hosts to filter
     int num_lines;  //num  of hosts in filter
+    access_log* log;    //access log of the requests, NULL if not requested
+    upstreams* upstream;    //virtual hosts balanced between backends, NULL if not requested
 } proxy_data_t;
 
 //the next structure will hold data of a request by the client
@@ -27,6 +34,7 @@ typedef struct request_data{
     unsigned int port;  //port of the server
     char* request;  //the parsed request
     char* host; //the parsed host
+    char* path; //the parsed path (access log use)
     char* protocol_type; // HTTP/1.0 or HTTP/.1.1
 } request_data_t;
 
@@ -42,8 +50,9 @@ proxy_data_t* parse_cmd(int argc , char* argv[]);
 char** get_filter(FILE* file , int* counter);
 
 //the next function is the (dispatch_fn) function which will be sent to the threads working,
-//the function gets a client fd socket and "handles" it. it parses the request, 
+//the function gets a connection (connection_t*) and "handles" it. it parses the request, 
 //if the request is valid the function attempts to connect the server, else it returns an error message to the client.
+//the function owns the connection and releases it to it's pool when done.
 int client_handler(void* arg);
 
 //the next function gets the request from the client (string) checks its validation and returns 
@@ -55,23 +64,41 @@ request_data_t* parse_request (char* str);
 //error message to a string to send later to the client. (used in client handler)
 char* error_handler (int flag , char* protocol_type);
 
-//the next function gets the data of a request and the client socket fd, and attempts to connect the server,
-//it returns the answer to the client immediately. (used in client handler)
-void connect_server(request_data_t* request_data , int client_sd);
+//the next function gets the data of a request, the client socket fd and the access log record of the request,
+//and attempts to connect the server (a backend of the upstream group, if the host is configured as one),
+//it returns the answer to the client immediately
+//and fills the status, bytes and durations in the record. (used in client handler)
+void connect_server(request_data_t* request_data , int client_sd , access_record_t* record);
+
+//the next function gets a response (or an error message) and returns it's status code, 0 if there is none.
+//(used to fill the access log record)
+int get_status(const char* response);
+
+//the next function gets the access log record of a request, fills the host, path and total duration
+//(since "start") and pushes it to the access log, if there is one. (used in client handler)
+void log_request(access_record_t* record , request_data_t* request_data , int64_t start);
+
+//the next function gets a connection and an error number, sends the error message to the client
+//and fills the status and bytes in the record. (used in client handler)
+void send_error(connection_t* conn , int flag , char* protocol_type , access_record_t* record);
 
 //the next function gets a structure of request data and deallocates all it's fields. (used in client handler)
 void destroy_data(request_data_t* request_data);
 
 //---------------------------------------==============----------------------------------//
 
+//every worker thread needs it's own access log ring, or it's records are dropped.
+_Static_assert(ACCESS_LOG_MAX_RINGS >= MAXT_IN_POOL, "ACCESS_LOG_MAX_RINGS must be at least MAXT_IN_POOL");
+
 ////-----------------------GLOBAL VARIABLE-----------------//
-proxy_data_t* data; //(filter use)  
+proxy_data_t* data; //(filter use) written only by parse_cmd before the threads are created, read only afterwards.
 //--------------------======-------------------------//
 
 //------------------------------------End Of Declarations--------------------------------//
 
 
 //---------------------------The Program-----------------------------------//
+#ifndef PROXY_NO_MAIN   //the tests link the rest of the file without main.
 int main (int argc , char* argv[])
 {
     data = parse_cmd(argc,argv); //check args.
@@ -83,6 +110,8 @@ int main (int argc , char* argv[])
 	    perror("socket");
 	    exit(1);
     }
+    int reuse = 1;  /* rebind the port while old connections are in TIME_WAIT */
+    setsockopt(welcome_sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     struct sockaddr_in srv;	/* used by bind() */
      /* create the socket */
     srv.sin_family = AF_INET; /* use the Internet addr family */
@@ -93,26 +122,44 @@ int main (int argc , char* argv[])
         perror("bind"); 
         exit(1);
     }
-    if(listen(welcome_sd, 5) < 0) 
+    if(listen(welcome_sd, SOMAXCONN) < 0) 
     {
 	    perror("listen");
 	    exit(1);
     }
+    connection_pool* connections = create_connection_pool(data->pool_size); //create pool of connection contexts.
+    if(connections == NULL)
+        return 0;
     threadpool* tp = create_threadpool(data->pool_size); //create threadpool.
     if(tp == NULL)
         return 0;
     for(int i = 0 ; i<data->num_request; i++)   //accept clients, for each client dispatch handler to threadpool.
     {
-        int newfd = accept(welcome_sd,(struct sockaddr*) NULL,NULL);
-        if(newfd < 0)
+        connection_t* conn = acquire_connection(connections);
+        if(conn == NULL)
             continue;
-        dispatch(tp,(dispatch_fn)client_handler,&newfd);
+        socklen_t addr_len = sizeof(conn->client_addr);
+        conn->fd = accept(welcome_sd,(struct sockaddr*)&(conn->client_addr),&addr_len);
+        if(conn->fd < 0)
+        {
+            release_connection(conn);
+            continue;
+        }
+        conn->accept_usec = access_log_now(CLOCK_MONOTONIC);
+        conn->accept_wall_usec = access_log_now(CLOCK_REALTIME);
+        if(dispatch(tp,(dispatch_fn)client_handler,conn) < 0) //case the job was not queued, the connection is still ours.
+            release_connection(conn);
     }
-    destroy_threadpool(tp);
+    destroy_threadpool(tp); //waits for the workers, so every connection is released.
+    destroy_connection_pool(connections);
 
     /*DESTROY PROXY DATA*/
     if(data != NULL)
     {
+        if(data->log != NULL)
+            destroy_access_log(data->log);  //writes the pending records.
+        if(data->upstream != NULL)
+            destroy_upstreams(data->upstream);
         if(data->filter != NULL)
         {
             for(int i = 0 ; i < data->num_lines ; i++)
@@ -125,19 +172,20 @@ int main (int argc , char* argv[])
     close(welcome_sd);
     return 0;
 }
+#endif
 
 proxy_data_t* parse_cmd(int argc , char* argv[])
 {
     //check for 4 arguments and atoi() of the last three argumenst.
-    if(argc != 5)
+    if(argc < 5 || argc > 7)
     {
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter> [<access-log>|-] [<upstreams>]\n");
         return NULL;
     }
     for(int i = 1; i < 4 ; i++)
         if(atoi(argv[i]) <= 0)
         {
-            printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+            printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter> [<access-log>|-] [<upstreams>]\n");
             return NULL;
         }
     //init data fields.
@@ -151,6 +199,8 @@ proxy_data_t* parse_cmd(int argc , char* argv[])
     data->pool_size = atoi(argv[2]);
     data->num_request = atoi(argv[3]);
     data->num_lines = 0;
+    data->log = NULL;
+    data->upstream = NULL;
     FILE* filterfile = fopen(argv[4], "r"); //open filter file.
     if(filterfile == NULL)
     {
@@ -161,6 +211,21 @@ proxy_data_t* parse_cmd(int argc , char* argv[])
     else
         data->filter = get_filter(filterfile,&(data->num_lines)); //convert the file to array of strings.
     fclose(filterfile);
+    if(argc >= 6 && strcmp(argv[5],"-") != 0)   //open the access log, if requested.
+    {
+        data->log = create_access_log(argv[5]);
+        if(data->log == NULL)
+        {
+            printf("FAILED OPEN ACCESS LOG FILE.");
+            exit(1);
+        }
+    }
+    if(argc == 7)   //read the upstream groups and start checking them.
+    {
+        data->upstream = create_upstreams(argv[6]);
+        if(data->upstream == NULL)
+            exit(1);
+    }
     return data;   
 }
 
@@ -204,30 +269,40 @@ request_data_t* parse_request (char* str)
     }
     request_data->port = 80;
     request_data->host = NULL;
+    request_data->path = NULL;
     request_data->request = NULL;
     request_data->protocol_type = NULL;
+    //strtok_r with local save pointers, the workers parse concurrently.
+    char* lines_save = NULL;
+    char* words_save = NULL;
     //get the first line of request.
-    char* first_line = strtok(str , "\r\n");
+    char* first_line = strtok_r(str , "\r\n" , &lines_save);
     if(first_line == NULL) //case no \r\n is in request
     {
         request_data->request = error_handler(400,"HTTP/1.0");
         return request_data;
     }
     //get rest of the lines 
-    char* rest_lines = strtok(NULL ,"\0");
-    char* method = strtok(first_line , " "); //get the first word
+    char* rest_lines = strtok_r(NULL ,"\0" , &lines_save);
+    char* method = strtok_r(first_line , " " , &words_save); //get the first word
     if(method == NULL)  //case of invalid first line.
     {
         request_data->request = error_handler(400,"HTTP/1.0");
         return request_data;
     }
-    char* path = strtok(NULL , " "); //get the second word.
+    char* path = strtok_r(NULL , " " , &words_save); //get the second word.
     if(path == NULL)    //case of invalid first line.
     {
         request_data->request = error_handler(400,"HTTP/1.0");
         return request_data;
     }
-    char* protocol_type = strtok(NULL , " "); //get the third word
+    request_data->path = strdup(path);
+    if(request_data->path == NULL)
+    {   
+        perror("MALLOC FAILED");
+        return NULL;
+    }
+    char* protocol_type = strtok_r(NULL , " " , &words_save); //get the third word
     if(protocol_type == NULL) //case of invalid first line.
     {
         request_data->request = error_handler(400,"HTTP/1.0");
@@ -250,7 +325,7 @@ request_data_t* parse_request (char* str)
         request_data->request = error_handler(400,request_data->protocol_type);
         return request_data;
     }
-    char* line = strtok(rest_lines , "\r\n"); //get the next line.
+    char* line = strtok_r(rest_lines , "\r\n" , &lines_save); //get the next line.
     char* host = NULL;
     while(line != NULL) //for each line in the request search for "Host:" , and get the host token.  
     {
@@ -260,7 +335,7 @@ request_data_t* parse_request (char* str)
                 while((*host) == ' ')
                     host++;
             }
-        line = strtok(NULL , "\r\n");
+        line = strtok_r(NULL , "\r\n" , &lines_save);
     }
     if(host == NULL) //case there is no host in the request (invalid).
     {
@@ -350,6 +425,16 @@ char* error_handler (int flag , char* protocol_type)
         error_type = "501 Not supported";
         error_description = "Method is not supported.";  
         content_length = "129";    
+        break;
+        case 502:
+        error_type = "502 Bad Gateway";
+        error_description = "Server is not reachable.";
+        content_length = "126";
+        break;
+        case 503:
+        error_type = "503 Service Unavailable";
+        error_description = "No server is available.";
+        content_length = "141";
     }
     char* error = (char*)calloc(300,sizeof(char));
     if(error == NULL)
@@ -375,103 +460,156 @@ char* error_handler (int flag , char* protocol_type)
 
 int client_handler(void* arg)
 {
-    int* client_sd = (int*)arg; //cast the socketfd to int*
+    connection_t* conn = (connection_t*)arg; //cast the connection, it's ours from now.
+    int64_t start = access_log_now(CLOCK_MONOTONIC);  //start of the work on the request (access log use).
+    access_record_t record; //access log record of the request.
+    memset(&record,0,sizeof(record));
+    record.timestamp_usec = conn->accept_wall_usec;
+    record.client_ip = conn->client_addr.sin_addr.s_addr;
+    record.queue_usec = start - conn->accept_usec;
     int rc ; //how many chars read.
-    int size = 0; // size to realloc the request.
-    char buffer[256]; //temporary buffer to hold read data.
-    char* request = (char*)calloc(1,sizeof(char));
-    if(request == NULL)
-    {
-        perror("MALLOC FAILED");
-        char* msg = error_handler(500,"HTTP/1.0");
-        write(*client_sd,msg,strlen(msg));
-        close(*client_sd);
-        free(msg);
-        return 0;
-    }
     request_data_t* request_data = NULL;
-    while(1)    //the loop reads request from the client and stores it in "request".
+    while(1)    //the loop reads request from the client and stores it in the connection buffer.
     {
-        memset(buffer,'\0',256);   // clear the buffer  
-        rc = read(*client_sd,buffer,255); 
+        if(connection_reserve(conn,255) < 0)    //make room for the next read.
+        {
+            send_error(conn,500,"HTTP/1.0",&record);
+            log_request(&record,NULL,conn->accept_usec);
+            release_connection(conn);
+            return 0;
+        }
+        rc = read(conn->fd,conn->buffer+conn->size,255); 
         if(rc == 0) //case read ended
             break;
         if (rc < 0) //case read failed
             break;
-        size += rc; //new size to realloc.
-        request = (char*)realloc(request,(size+1)*(sizeof(char))); //reallocing the size to concatenate the request.
-        if(request == NULL)
-        {
-            perror("MALLOC FAILED");
-            char* msg = error_handler(500,request_data->protocol_type);
-            write(*client_sd,msg,strlen(msg));
-            close(*client_sd);
-            free(msg);
-            destroy_data(request_data);
-            return 0;
-        }
-        strcat(request,buffer);
-        if(strstr(request,"\r\n\r\n") != NULL)  //request ends with "\r\n\r\n"
+        int searched = conn->size > 3 ? conn->size-3 : 0; //the end may start in the previous read.
+        conn->size += rc;
+        conn->buffer[conn->size] = '\0';
+        if(strstr(conn->buffer+searched,"\r\n\r\n") != NULL)  //request ends with "\r\n\r\n"
             break;
     }
-    request_data = parse_request(request);  
-    free(request);  //no longer needed.
+    int64_t parse_start = access_log_now(CLOCK_MONOTONIC);
+    record.read_usec = parse_start - start;
+    request_data = parse_request(conn->buffer);  
+    record.parse_usec = access_log_now(CLOCK_MONOTONIC) - parse_start;
     if(request_data == NULL)    //problem occured in parse_reqeust (probably malloc).
     {
-        char* msg = error_handler(500,request_data->protocol_type);
-        write(*client_sd,msg,strlen(msg));
-        close(*client_sd);
-        free(msg);
-        destroy_data(request_data);
+        send_error(conn,500,"HTTP/1.0",&record);
+        log_request(&record,NULL,conn->accept_usec);
+        release_connection(conn);
         return 0;
     }
     if(request_data->host == NULL)  //not a valid request (error message stored in request_data->request).
     {
-        write(*client_sd,request_data->request,strlen(request_data->request));
-        close(*client_sd);
+        rc = write(conn->fd,request_data->request,strlen(request_data->request));
+        record.status = get_status(request_data->request);
+        record.bytes = rc > 0 ? rc : 0;
+        log_request(&record,request_data,conn->accept_usec);
         destroy_data(request_data);
+        release_connection(conn);
         return 0;
     }
-    connect_server(request_data,*client_sd); 
-    close(*client_sd);
+    connect_server(request_data,conn->fd,&record); 
+    log_request(&record,request_data,conn->accept_usec);
     destroy_data(request_data);
+    release_connection(conn);   //closes the client socket.
     return 0;
 }
 
-void connect_server(request_data_t* request_data , int client_sd)
+void send_error(connection_t* conn , int flag , char* protocol_type , access_record_t* record)
+{
+    char* msg = error_handler(flag,protocol_type);
+    if(msg == NULL)
+        return;
+    int rc = write(conn->fd,msg,strlen(msg));
+    record->status = flag;
+    record->bytes = rc > 0 ? rc : 0;
+    free(msg);
+}
+
+void connect_server(request_data_t* request_data , int client_sd , access_record_t* record)
 {
     struct sockaddr_in serv_addr;
-    struct hostent* server;
+    struct addrinfo hints;
+    struct addrinfo* server = NULL;
+    upstream_group_t* group = NULL;   //the upstream group of the host, NULL if dialed directly.
+    backend_t* backend = NULL;  //the chosen backend of the group.
     int rc ,server_sd ;
     unsigned char uc_buffer[256];
-    server = gethostbyname(request_data->host);  //parse the host (get ip address).
+    int64_t connect_start = access_log_now(CLOCK_MONOTONIC);
     server_sd = socket(AF_INET , SOCK_STREAM , 0); //opening the socket to the server
     if (server_sd <0)  //case fd failed
     {
         char* msg = error_handler(500,request_data->protocol_type);
-        write(client_sd,msg,strlen(msg));
+        rc = write(client_sd,msg,strlen(msg));
+        record->status = 500;
+        record->bytes = rc > 0 ? rc : 0;
         free(msg);
         return;
     }
-    if (server == NULL) //case the host does not exist.
+    memset(&serv_addr,0,sizeof(serv_addr));
+    group = find_upstream(data->upstream,request_data->host);
+    if(group != NULL)   //case of configured virtual host, balance between it's backends.
     {
-        char* msg = error_handler(404,request_data->protocol_type);
-        write(client_sd,msg,strlen(msg));
-        free(msg);
-        return;
+        backend = pick_backend(group);
+        if(backend == NULL) //case all the backends are down or ejected.
+        {
+            close(server_sd);
+            char* msg = error_handler(503,request_data->protocol_type);
+            rc = write(client_sd,msg,strlen(msg));
+            record->status = 503;
+            record->bytes = rc > 0 ? rc : 0;
+            free(msg);
+            return;
+        }
+        serv_addr = backend->addr;
+        struct timeval timeout; //limit connect, instead of the kernel SYN timeout.
+        timeout.tv_sec = UPSTREAM_CONNECT_TIMEOUT_SEC;
+        timeout.tv_usec = 0;
+        setsockopt(server_sd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+    }
+    else
+    {
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if(getaddrinfo(request_data->host,NULL,&hints,&server) != 0)  //parse the host (get ip address), thread safe unlike gethostbyname.
+            server = NULL;
+        if (server == NULL) //case the host does not exist.
+        {
+            close(server_sd);
+            char* msg = error_handler(404,request_data->protocol_type);
+            rc = write(client_sd,msg,strlen(msg));
+            record->status = 404;
+            record->bytes = rc > 0 ? rc : 0;
+            free(msg);
+            return;
+        }
+        //the next 3 lines initialize the internet socket address
+        serv_addr.sin_family = AF_INET; 
+        serv_addr.sin_addr = ((struct sockaddr_in*)server->ai_addr)->sin_addr;
+        serv_addr.sin_port = htons(request_data->port);
+        freeaddrinfo(server);
     }
-    //the next 3 lines initialize the internet socket address
-    memset(&serv_addr,0,sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET; 
-    bcopy((char*)server->h_addr_list[0] , (char*)&serv_addr.sin_addr.s_addr,server->h_length);
-    serv_addr.sin_port = htons(request_data->port);
     if (connect(server_sd,(const struct sockaddr*)&serv_addr,sizeof(serv_addr)) < 0)
     {
-        char* msg = error_handler(404,request_data->protocol_type);
-        write(client_sd,msg,strlen(msg));
+        close(server_sd);
+        backend_done(group,backend,0,0);    //passive health check of the backend (if any).
+        int flag = backend != NULL ? 502 : 404; //a backend of a configured host is down, not missing.
+        char* msg = error_handler(flag,request_data->protocol_type);
+        rc = write(client_sd,msg,strlen(msg));
+        record->status = flag;
+        record->bytes = rc > 0 ? rc : 0;
+        record->connect_usec = access_log_now(CLOCK_MONOTONIC) - connect_start;
         free(msg);
         return;
     }
+    int64_t relay_start = access_log_now(CLOCK_MONOTONIC);
+    int64_t first_byte = 0;   //time the first chunk of the response arrived (backend latency).
+    char status_line[13];   //the first 12 bytes of the response ("HTTP/1.x NNN"), may arrive in more than one chunk.
+    int status_len = 0;
+    record->connect_usec = relay_start - connect_start;
     write(server_sd,request_data->request,strlen(request_data->request));   //send the request to the server
     while(1)    //the loop reads the respose from the server, and sends to client immediately.
     {
@@ -481,8 +619,60 @@ void connect_server(request_data_t* request_data , int client_sd)
             break;
         if (rc == 0) // case there is no more chars to read
             break;
-        send(client_sd, uc_buffer, rc, MSG_NOSIGNAL );
+        if(first_byte == 0)
+            first_byte = access_log_now(CLOCK_MONOTONIC);
+        if(status_len < 12) //collect the status line before parsing it.
+        {
+            int len = rc < 12 - status_len ? rc : 12 - status_len;
+            memcpy(status_line+status_len,uc_buffer,len);
+            status_len += len;
+            status_line[status_len] = '\0';
+            if(status_len == 12)
+                record->status = get_status(status_line);
+        }
+        int sent = send(client_sd, uc_buffer, rc, MSG_NOSIGNAL );
+        if(sent > 0)
+            record->bytes += sent;
+    }
+    close(server_sd);
+    int64_t relay_end = access_log_now(CLOCK_MONOTONIC);
+    record->relay_usec = relay_end - relay_start;
+    if(first_byte == 0) //case the server closed (or the read failed) before any response byte.
+    {
+        backend_done(group,backend,0,0);    //a failure, not a latency sample.
+        char* msg = error_handler(502,request_data->protocol_type);   //nothing was relayed yet.
+        rc = write(client_sd,msg,strlen(msg));
+        record->status = 502;
+        record->bytes = rc > 0 ? rc : 0;
+        free(msg);
+        return;
+    }
+    backend_done(group,backend,1,first_byte - connect_start);
+}
+
+int get_status(const char* response)
+{
+    if(response == NULL || strncmp(response,"HTTP/",5) != 0)   //case there is no status line.
+        return 0;
+    const char* code = strchr(response,' ');
+    if(code == NULL)
+        return 0;
+    return atoi(code+1);
+}
+
+void log_request(access_record_t* record , request_data_t* request_data , int64_t start)
+{
+    if(data->log == NULL)   //case access log was not requested.
+        return;
+    if(request_data != NULL)
+    {
+        if(request_data->host != NULL)
+            strncpy(record->host,request_data->host,ACCESS_LOG_HOST_LEN-1);
+        if(request_data->path != NULL)
+            strncpy(record->path,request_data->path,ACCESS_LOG_PATH_LEN-1);
     }
+    record->total_usec = access_log_now(CLOCK_MONOTONIC) - start;
+    access_log_push(data->log,record);
 }
 
 void destroy_data(request_data_t* request_data)
@@ -492,6 +682,8 @@ void destroy_data(request_data_t* request_data)
     {
         if(request_data->host != NULL)
             free(request_data->host);
+        if(request_data->path != NULL)
+            free(request_data->path);
         if(request_data->protocol_type != NULL)
             free(request_data->protocol_type);
         if(request_data->request != NULL)
@@ -0,0 +1,148 @@
+#include "../accesslog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/**
+ * test_accesslog.c
+ *
+ * unit tests of the access log: dropping and reporting records when a ring is
+ * full, rotation to "<path>.1" and the ring of a thread which logs to a new log.
+ * built with -fsanitize=thread and a lowered ACCESS_LOG_MAX_BYTES by "make check".
+ */
+
+#define ROTATE_RECORDS 40
+#define PATH_SIZE 256
+
+static int failures = 0;
+
+#define CHECK(cond) do{ if(!(cond)) { printf("%s:%d: CHECK FAILED: %s\n",__FILE__,__LINE__,#cond); failures++; } }while(0)
+
+static char dir[] = "/tmp/test_accesslog_XXXXXX";
+
+//the next function fills "record" with fixed values, so every line of the log has the same length.
+static void make_record(access_record_t* record, int i)
+{
+    memset(record,0,sizeof(access_record_t));
+    record->timestamp_usec = 1000000;
+    record->status = 200;
+    record->bytes = 1000;
+    snprintf(record->host,sizeof(record->host),"test.host");
+    snprintf(record->path,sizeof(record->path),"/record%04d",i);
+}
+
+//the next function counts the lines of "path" which start with "prefix" (0 if there is no file).
+static int count_lines(const char* path, const char* prefix)
+{
+    FILE* file = fopen(path,"r");
+    if(file == NULL)
+        return 0;
+    char line[512];
+    int count = 0;
+    while(fgets(line,sizeof(line),file) != NULL)
+        if(strncmp(line,prefix,strlen(prefix)) == 0)
+            count++;
+    fclose(file);
+    return count;
+}
+
+//the next function builds "<dir>/<name>" in "path" and "<dir>/<name>.1" in "rotated", and removes old files of them.
+static void log_path(char* path, char* rotated, const char* name)
+{
+    snprintf(path,PATH_SIZE,"%s/%s",dir,name);
+    snprintf(rotated,PATH_SIZE,"%s/%s.1",dir,name);
+    unlink(path);
+    unlink(rotated);
+}
+
+//records pushed while the drain thread is stalled fill the ring, the rest are
+//dropped, counted, and reported by a "# dropped" line once it runs again.
+static void test_full_ring_drops(void)
+{
+    char path[PATH_SIZE];
+    char rotated[PATH_SIZE];
+    log_path(path,rotated,"full.log");
+    access_log* log = create_access_log(path);
+    CHECK(log != NULL);
+    if(log == NULL)
+        return;
+    flockfile(log->file);   //the drain thread blocks on it's first record, the tail of the ring stays.
+    access_record_t record;
+    for(int i = 0 ; i < ACCESS_LOG_RING_SIZE+10 ; i++)
+    {
+        make_record(&record,i);
+        access_log_push(log,&record);
+    }
+    CHECK(atomic_load(&(log->dropped)) == 10);
+    funlockfile(log->file);
+    destroy_access_log(log);
+    //the last batch may have been rotated (ACCESS_LOG_MAX_BYTES is lowered).
+    CHECK(count_lines(path,"# dropped 10 records (total 10)") + count_lines(rotated,"# dropped 10 records (total 10)") == 1);
+    unlink(path);
+    unlink(rotated);
+}
+
+//a file which crossed ACCESS_LOG_MAX_BYTES is renamed to "<path>.1" and a new one is started.
+static void test_rotation(void)
+{
+    char path[PATH_SIZE];
+    char rotated[PATH_SIZE];
+    log_path(path,rotated,"rotate.log");
+    access_log* log = create_access_log(path);
+    CHECK(log != NULL);
+    if(log == NULL)
+        return;
+    access_record_t record;
+    for(int i = 0 ; i < ROTATE_RECORDS ; i++)
+    {
+        make_record(&record,i);
+        access_log_push(log,&record);
+        usleep(1000);   //spread the records between batches.
+    }
+    destroy_access_log(log);
+    CHECK(access(rotated,F_OK) == 0);
+    //ROTATE_RECORDS lines are less than twice ACCESS_LOG_MAX_BYTES, so no line was rotated out.
+    CHECK(count_lines(path,"") + count_lines(rotated,"") == ROTATE_RECORDS);
+    CHECK(count_lines(path,"#") + count_lines(rotated,"#") == 0);
+    unlink(path);
+    unlink(rotated);
+}
+
+//a thread which logged to a destroyed log gets a new ring in the next one.
+static void test_ring_of_new_log(void)
+{
+    char path[PATH_SIZE];
+    char rotated[PATH_SIZE];
+    access_record_t record;
+    make_record(&record,0);
+    for(int i = 0 ; i < 2 ; i++)
+    {
+        log_path(path,rotated,"again.log");
+        access_log* log = create_access_log(path);
+        CHECK(log != NULL);
+        if(log == NULL)
+            return;
+        access_log_push(log,&record);
+        CHECK(atomic_load(&(log->num_rings)) == 1);
+        destroy_access_log(log);
+        CHECK(count_lines(path,"") == 1);
+        unlink(path);
+    }
+}
+
+int main(void)
+{
+    if(mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    test_full_ring_drops();
+    test_rotation();
+    test_ring_of_new_log();
+    rmdir(dir);
+    printf("test_accesslog: %s\n",failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
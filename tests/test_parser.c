@@ -0,0 +1,161 @@
+#define PROXY_NO_MAIN
+#include "../proxyServer.c"
+
+/**
+ * test_parser.c
+ *
+ * unit tests of parse_request, error_handler and get_status.
+ * the proxy is included without it's main, so the tests see it's structures.
+ * built with -fsanitize=thread by "make check".
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) do{ if(!(cond)) { printf("%s:%d: CHECK FAILED: %s\n",__FILE__,__LINE__,#cond); failures++; } }while(0)
+
+//the next function parses a copy of "str" (parse_request changes it's argument).
+static request_data_t* parse(const char* str)
+{
+    char* copy = strdup(str);
+    request_data_t* request_data = parse_request(copy);
+    free(copy);
+    return request_data;
+}
+
+//the next function parses an invalid request and returns the status of the error message.
+static int parse_error(const char* str)
+{
+    request_data_t* request_data = parse(str);
+    CHECK(request_data != NULL);
+    if(request_data == NULL)
+        return 0;
+    CHECK(request_data->host == NULL);
+    int status = get_status(request_data->request);
+    destroy_data(request_data);
+    return status;
+}
+
+static void test_valid_request(void)
+{
+    request_data_t* request_data = parse("GET /index.html HTTP/1.1\r\nAccept: */*\r\nHost: www.example.com:8080\r\n\r\n");
+    CHECK(request_data != NULL);
+    CHECK(request_data->host != NULL && strcmp(request_data->host,"www.example.com") == 0);
+    CHECK(request_data->port == 8080);
+    CHECK(request_data->path != NULL && strcmp(request_data->path,"/index.html") == 0);
+    CHECK(strcmp(request_data->protocol_type,"HTTP/1.1") == 0);
+    CHECK(strcmp(request_data->request,"GET /index.html HTTP/1.1\r\nHost: www.example.com:8080\r\nConnection: close\r\n\r\n") == 0);
+    destroy_data(request_data);
+
+    request_data = parse("GET / HTTP/1.0\r\nHost:   www.example.com\r\n\r\n");
+    CHECK(request_data != NULL);
+    CHECK(request_data->host != NULL && strcmp(request_data->host,"www.example.com") == 0);
+    CHECK(request_data->port == 80);  //default port.
+    destroy_data(request_data);
+}
+
+static void test_invalid_requests(void)
+{
+    CHECK(parse_error("") == 400);
+    CHECK(parse_error("GET / HTTP/1.0") == 400);   //only one line.
+    CHECK(parse_error("GET /\r\nHost: a\r\n\r\n") == 400);   //no protocol.
+    CHECK(parse_error("GET / HTTP/2.0\r\nHost: a\r\n\r\n") == 400);
+    CHECK(parse_error("GET / HTTP/1.1\r\nAccept: */*\r\n\r\n") == 404);   //no host.
+    CHECK(parse_error("GET / HTTP/1.1\r\nHost: a:x\r\n\r\n") == 404);   //invalid port.
+    CHECK(parse_error("POST / HTTP/1.1\r\nHost: a\r\n\r\n") == 501);
+    CHECK(parse_error("GET / HTTP/1.1\r\nHost: www.cnn.com\r\n\r\n") == 403);   //filtered.
+}
+
+//the next function checks the status line and that Content-Length matches the body.
+static void check_error_message(int flag, const char* status_line)
+{
+    char* msg = error_handler(flag,"HTTP/1.1");
+    CHECK(msg != NULL);
+    if(msg == NULL)
+        return;
+    CHECK(strncmp(msg,status_line,strlen(status_line)) == 0);
+    CHECK(get_status(msg) == flag);
+    char* length = strstr(msg,"Content-Length: ");
+    char* body = strstr(msg,"\r\n\r\n");
+    CHECK(length != NULL && body != NULL);
+    if(length != NULL && body != NULL)
+        CHECK(atoi(length+16) == (int)strlen(body+4));
+    free(msg);
+}
+
+static void test_error_handler(void)
+{
+    check_error_message(502,"HTTP/1.1 502 Bad Gateway\r\n");
+    check_error_message(503,"HTTP/1.1 503 Service Unavailable\r\n");
+    char* msg = error_handler(404,"HTTP/1.0");
+    CHECK(msg != NULL && strncmp(msg,"HTTP/1.0 404 Not Found\r\n",24) == 0);
+    free(msg);
+}
+
+static void test_get_status(void)
+{
+    CHECK(get_status("HTTP/1.1 200 OK\r\n") == 200);
+    CHECK(get_status("HTTP/1.0 204") == 204);
+    CHECK(get_status("HTT") == 0);
+    CHECK(get_status("garbage") == 0);
+    CHECK(get_status(NULL) == 0);
+}
+
+#define PARSE_THREADS 8
+#define PARSES_PER_THREAD 20000
+
+//the next function is a worker of test_concurrent_parse, it parses requests only it sends
+//and returns (as the thread result) how many of them came back with another request's fields.
+static void* parse_worker(void* arg)
+{
+    long id = (long)arg;
+    long mismatches = 0;
+    char str[256];
+    char host[64];
+    char path[64];
+    for(int i = 0 ; i < PARSES_PER_THREAD ; i++)
+    {
+        snprintf(host,sizeof(host),"host%ld-%d.test",id,i);
+        snprintf(path,sizeof(path),"/thread%ld/request%d",id,i);
+        snprintf(str,sizeof(str),"GET %s HTTP/1.1\r\nAccept: */*\r\nUser-Agent: test\r\nHost: %s:%ld\r\nX-Worker: %ld\r\n\r\n",
+            path,host,1000+id,id);
+        request_data_t* request_data = parse_request(str);
+        if(request_data == NULL || request_data->host == NULL || strcmp(request_data->host,host) != 0
+            || request_data->path == NULL || strcmp(request_data->path,path) != 0 || request_data->port != 1000+id)
+            mismatches++;
+        destroy_data(request_data);
+    }
+    return (void*)mismatches;
+}
+
+//workers parse at the same time, every result must belong to the request it parsed.
+static void test_concurrent_parse(void)
+{
+    pthread_t threads[PARSE_THREADS];
+    for(long i = 0 ; i < PARSE_THREADS ; i++)
+        pthread_create(&threads[i],NULL,parse_worker,(void*)i);
+    long mismatches = 0;
+    for(int i = 0 ; i < PARSE_THREADS ; i++)
+    {
+        void* result;
+        pthread_join(threads[i],&result);
+        mismatches += (long)result;
+    }
+    CHECK(mismatches == 0);
+}
+
+int main(void)
+{
+    //proxy data as parse_cmd would build it, with one filtered host.
+    char* filter[] = {"www.cnn.com"};
+    data = (proxy_data_t*)calloc(1,sizeof(proxy_data_t));
+    data->filter = filter;
+    data->num_lines = 1;
+    test_valid_request();
+    test_invalid_requests();
+    test_error_handler();
+    test_get_status();
+    test_concurrent_parse();
+    free(data);
+    printf("test_parser: %s\n",failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
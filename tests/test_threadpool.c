@@ -0,0 +1,131 @@
+#include "../threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/**
+ * test_threadpool.c
+ *
+ * unit tests of the threadpool: dispatch, ownership of the job argument,
+ * draining the queue and shutting down. built with -fsanitize=thread by "make check".
+ */
+
+#define NUM_JOBS 1000
+
+static int failures = 0;
+
+#define CHECK(cond) do{ if(!(cond)) { printf("%s:%d: CHECK FAILED: %s\n",__FILE__,__LINE__,#cond); failures++; } }while(0)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int runs[NUM_JOBS];  //how many times the job with each id ran
+static int num_runs = 0;
+
+//the next function is a job, it gets an allocated id (owned by the job) and counts it's run.
+static int count_job(void* arg)
+{
+    int id = *(int*)arg;
+    free(arg);  //the job owns it's argument.
+    pthread_mutex_lock(&lock);
+    runs[id]++;
+    num_runs++;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+//the next function is a slow job, so the queue is not empty when destroy begins.
+static int slow_job(void* arg)
+{
+    usleep(1000);
+    return count_job(arg);
+}
+
+//the next function dispatches NUM_JOBS jobs with distinct ids to the pool.
+static void dispatch_jobs(threadpool* tp, dispatch_fn job)
+{
+    for(int i = 0 ; i < NUM_JOBS ; i++)
+    {
+        int* id = (int*)malloc(sizeof(int));
+        *id = i;
+        if(dispatch(tp,job,id) < 0) //case the job was not queued, the argument is still ours.
+            free(id);
+    }
+}
+
+static void reset_runs(void)
+{
+    pthread_mutex_lock(&lock);
+    memset(runs,0,sizeof(runs));
+    num_runs = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+//every job runs exactly once and sees it's own argument.
+static void test_dispatch_runs_each_job_once(void)
+{
+    reset_runs();
+    threadpool* tp = create_threadpool(8);
+    CHECK(tp != NULL);
+    dispatch_jobs(tp,count_job);
+    destroy_threadpool(tp);
+    CHECK(num_runs == NUM_JOBS);
+    for(int i = 0 ; i < NUM_JOBS ; i++)
+        CHECK(runs[i] == 1);
+}
+
+//destroy waits for every queued job before the threads exit.
+static void test_destroy_drains_queue(void)
+{
+    reset_runs();
+    threadpool* tp = create_threadpool(2);
+    CHECK(tp != NULL);
+    for(int i = 0 ; i < 50 ; i++)
+    {
+        int* id = (int*)malloc(sizeof(int));
+        *id = i;
+        CHECK(dispatch(tp,slow_job,id) == 0);
+    }
+    destroy_threadpool(tp);
+    CHECK(num_runs == 50);
+}
+
+//dispatch refuses jobs once destroy began, and the caller keeps ownership.
+static void test_dispatch_after_shutdown_keeps_ownership(void)
+{
+    threadpool* tp = create_threadpool(2);
+    CHECK(tp != NULL);
+    pthread_mutex_lock(&(tp->qlock));
+    tp->dont_accept = 1;    //as destroy_threadpool does.
+    pthread_mutex_unlock(&(tp->qlock));
+    int* id = (int*)malloc(sizeof(int));
+    *id = 0;
+    CHECK(dispatch(tp,count_job,id) == -1);
+    free(id);   //still ours, the job never ran.
+    pthread_mutex_lock(&(tp->qlock));
+    CHECK(tp->qsize == 0);
+    tp->dont_accept = 0;
+    pthread_mutex_unlock(&(tp->qlock));
+    destroy_threadpool(tp);
+    CHECK(dispatch(NULL,count_job,NULL) == -1);
+}
+
+//invalid sizes are refused, and an idle pool shuts down.
+static void test_create_and_destroy(void)
+{
+    CHECK(create_threadpool(0) == NULL);
+    CHECK(create_threadpool(MAXT_IN_POOL+1) == NULL);
+    threadpool* tp = create_threadpool(MAXT_IN_POOL);
+    CHECK(tp != NULL);
+    destroy_threadpool(tp);
+}
+
+int main(void)
+{
+    test_dispatch_runs_each_job_once();
+    test_destroy_drains_queue();
+    test_dispatch_after_shutdown_keeps_ownership();
+    test_create_and_destroy();
+    printf("\ntest_threadpool: %s\n",failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
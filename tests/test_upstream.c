@@ -0,0 +1,276 @@
+#define PROXY_NO_MAIN
+#include "../proxyServer.c"
+
+/**
+ * test_upstream.c
+ *
+ * tests of the upstream groups against local stub backends: active health
+ * checks, passive ejection, 502/503 answers and ewma balancing, and a backend
+ * which closes connections without a response.
+ * requests go through connect_server, the client is one end of a socketpair.
+ * built with -fsanitize=thread by "make check".
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) do{ if(!(cond)) { printf("%s:%d: CHECK FAILED: %s\n",__FILE__,__LINE__,#cond); failures++; } }while(0)
+
+//the next structure holds a stub backend, which answers every request with "status"
+//(status 0 closes the connection without a response).
+typedef struct stub{
+    int sd;             //listening socket
+    int port;
+    int status;         //status of the responses
+    int delay_usec;     //delay before answering a test request
+    _Atomic int hits;   //test requests served (health checks are not counted)
+} stub_t;
+
+//the next function is the thread of a stub backend.
+static void* stub_serve(void* arg)
+{
+    stub_t* stub = (stub_t*)arg;
+    char buffer[1024];
+    char response[128];
+    snprintf(response,sizeof(response),"HTTP/1.0 %d Stub\r\nContent-Length: 2\r\n\r\nok",stub->status);
+    while(1)
+    {
+        int sd = accept(stub->sd,NULL,NULL);
+        if(sd < 0)
+            continue;
+        int size = 0;
+        while(size < (int)sizeof(buffer)-1) //read the request until "\r\n\r\n".
+        {
+            int rc = read(sd,buffer+size,sizeof(buffer)-1-size);
+            if(rc <= 0)
+                break;
+            size += rc;
+            buffer[size] = '\0';
+            if(strstr(buffer,"\r\n\r\n") != NULL)
+                break;
+        }
+        if(size >= 8 && strncmp(buffer,"GET /req",8) == 0)    //case of a test request (not a health check).
+        {
+            atomic_fetch_add(&(stub->hits),1);
+            usleep(stub->delay_usec);
+        }
+        if(stub->status != 0)
+            write(sd,response,strlen(response));
+        close(sd);
+    }
+    return NULL;
+}
+
+//the next function returns a local socket bound to a free port, listening if "do_listen".
+static int bind_free_port(int do_listen, int* port)
+{
+    int sd = socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if(sd < 0 || bind(sd,(struct sockaddr*)&addr,sizeof(addr)) < 0
+        || (do_listen && listen(sd,SOMAXCONN) < 0) || getsockname(sd,(struct sockaddr*)&addr,&addr_len) < 0)
+    {
+        perror("stub");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+    return sd;
+}
+
+static void start_stub(stub_t* stub, int status, int delay_usec)
+{
+    stub->sd = bind_free_port(1,&(stub->port));
+    stub->status = status;
+    stub->delay_usec = delay_usec;
+    atomic_init(&(stub->hits),0);
+    pthread_t thread;
+    pthread_create(&thread,NULL,stub_serve,stub);
+    pthread_detach(thread);
+}
+
+//the next function sends a request for "host" through connect_server and returns the status the client got.
+static int send_request(const char* host)
+{
+    char str[128];
+    snprintf(str,sizeof(str),"GET /req HTTP/1.0\r\nHost: %s\r\n\r\n",host);
+    request_data_t* request_data = parse_request(str);
+    CHECK(request_data != NULL && request_data->host != NULL);
+    if(request_data == NULL)
+        return 0;
+    int sds[2];
+    if(socketpair(AF_UNIX,SOCK_STREAM,0,sds) < 0)
+    {
+        perror("socketpair");
+        exit(1);
+    }
+    access_record_t record;
+    memset(&record,0,sizeof(record));
+    connect_server(request_data,sds[0],&record);
+    close(sds[0]);
+    char response[512];
+    int size = 0;
+    int rc;
+    while(size < (int)sizeof(response)-1 && (rc = read(sds[1],response+size,sizeof(response)-1-size)) > 0)
+        size += rc;
+    response[size] = '\0';
+    close(sds[1]);
+    destroy_data(request_data);
+    CHECK(record.status == get_status(response));   //the access log sees what the client got.
+    return get_status(response);
+}
+
+//the next function finds the backend of "group" on "port".
+static backend_t* find_backend(upstream_group_t* group, int port)
+{
+    for(int i = 0 ; i < group->num_backends ; i++)
+        if(ntohs(group->backends[i].addr.sin_port) == port)
+            return &(group->backends[i]);
+    return NULL;
+}
+
+//the next function reads "healthy" of a backend under the lock of it's group.
+static int is_healthy(upstream_group_t* group, backend_t* backend)
+{
+    pthread_mutex_lock(&(group->lock));
+    int healthy = backend->healthy;
+    pthread_mutex_unlock(&(group->lock));
+    return healthy;
+}
+
+static stub_t ok_stub, error_stub, fast_stub, slow_stub, drop_stub;
+static int refused_port;
+
+//a backend answering 5xx or refusing the health check is unhealthy, a backend answering 200 is healthy.
+static void test_health_check(upstream_group_t* group)
+{
+    backend_t* ok = find_backend(group,ok_stub.port);
+    backend_t* error = find_backend(group,error_stub.port);
+    backend_t* refused = find_backend(group,refused_port);
+    CHECK(ok != NULL && error != NULL && refused != NULL);
+    CHECK(is_healthy(group,ok) == 1);
+    CHECK(is_healthy(group,error) == 0);
+    CHECK(is_healthy(group,refused) == 0);
+    for(int i = 0 ; i < 5 ; i++)    //only the healthy backend gets requests.
+        CHECK(send_request("health.test") == 200);
+    CHECK(atomic_load(&(ok_stub.hits)) == 5);
+    CHECK(atomic_load(&(error_stub.hits)) == 0);
+}
+
+//a group without an available backend answers 503.
+static void test_no_backend(void)
+{
+    CHECK(send_request("dead.test") == 503);
+}
+
+//three failed connects answer 502 and eject the backend for UPSTREAM_EJECT_USEC.
+static void test_ejection(upstream_group_t* group)
+{
+    backend_t* refused = find_backend(group,refused_port);
+    CHECK(refused != NULL);
+    int bad_gateways = 0;
+    for(int i = 0 ; i < 10 ; i++)
+    {
+        pthread_mutex_lock(&(group->lock));
+        refused->healthy = 1;   //as if it passed the last health check, only passive checks count.
+        pthread_mutex_unlock(&(group->lock));
+        int status = send_request("eject.test");
+        CHECK(status == 200 || status == 502);
+        if(status == 502)
+            bad_gateways++;
+    }
+    CHECK(bad_gateways == UPSTREAM_EJECT_FAILURES);
+    int64_t now = access_log_now(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&(group->lock));
+    int64_t ejected_until = refused->ejected_until;
+    pthread_mutex_unlock(&(group->lock));
+    CHECK(ejected_until > now + UPSTREAM_EJECT_USEC - 1000000);
+    CHECK(ejected_until <= now + UPSTREAM_EJECT_USEC);
+}
+
+//ewma balancing sends the requests to the faster backend once both were measured.
+static void test_ewma(void)
+{
+    for(int i = 0 ; i < 10 ; i++)
+        CHECK(send_request("ewma.test") == 200);
+    CHECK(atomic_load(&(slow_stub.hits)) <= 1);
+    CHECK(atomic_load(&(fast_stub.hits)) >= 9);
+}
+
+//a backend which accepts and closes without a response answers 502, counts as a failure
+//and is ejected, and it's latency is never sampled (it would win the ewma balancing).
+static void test_no_response(upstream_group_t* group)
+{
+    backend_t* drop = find_backend(group,drop_stub.port);
+    CHECK(drop != NULL);
+    int bad_gateways = 0;
+    for(int i = 0 ; i < 10 ; i++)
+    {
+        pthread_mutex_lock(&(group->lock));
+        drop->healthy = 1;  //as if it passed the last health check, only passive checks count.
+        pthread_mutex_unlock(&(group->lock));
+        int status = send_request("drop.test");
+        CHECK(status == 200 || status == 502);
+        if(status == 502)
+            bad_gateways++;
+    }
+    CHECK(bad_gateways == UPSTREAM_EJECT_FAILURES);
+    CHECK(atomic_load(&(drop_stub.hits)) == UPSTREAM_EJECT_FAILURES);
+    pthread_mutex_lock(&(group->lock));
+    int64_t ewma_usec = drop->ewma_usec;
+    int64_t ejected_until = drop->ejected_until;
+    pthread_mutex_unlock(&(group->lock));
+    CHECK(ewma_usec == 0);
+    CHECK(ejected_until > access_log_now(CLOCK_MONOTONIC));
+}
+
+int main(void)
+{
+    start_stub(&ok_stub,200,0);
+    start_stub(&error_stub,500,0);
+    start_stub(&fast_stub,200,0);
+    start_stub(&slow_stub,200,50000);
+    start_stub(&drop_stub,0,0);
+    close(bind_free_port(0,&refused_port)); //nothing listens on it, connects are refused.
+    //WRITE THE UPSTREAMS FILE:
+    char path[] = "/tmp/test_upstream_XXXXXX";
+    int fd = mkstemp(path);
+    FILE* file = fd < 0 ? NULL : fdopen(fd,"w");
+    if(file == NULL)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    fprintf(file,"# groups of the test\n");
+    fprintf(file,"health.test least 127.0.0.1:%d 127.0.0.1:%d 127.0.0.1:%d\n",ok_stub.port,error_stub.port,refused_port);
+    fprintf(file,"dead.test least 127.0.0.1:%d\n",refused_port);
+    fprintf(file,"eject.test least 127.0.0.1:%d 127.0.0.1:%d\n",refused_port,ok_stub.port);
+    fprintf(file,"ewma.test ewma 127.0.0.1:%d 127.0.0.1:%d\n",slow_stub.port,fast_stub.port);
+    fprintf(file,"drop.test ewma 127.0.0.1:%d 127.0.0.1:%d\n",drop_stub.port,ok_stub.port);
+    fclose(file);
+    //proxy data as parse_cmd would build it, without filter.
+    data = (proxy_data_t*)calloc(1,sizeof(proxy_data_t));
+    data->upstream = create_upstreams(path);
+    unlink(path);
+    CHECK(data->upstream != NULL);
+    if(data->upstream == NULL)
+        return 1;
+    upstream_group_t* health = find_upstream(data->upstream,"health.test");
+    CHECK(health != NULL && find_upstream(data->upstream,"HEALTH.test") == health);
+    CHECK(find_upstream(data->upstream,"other.test") == NULL);
+    //WAIT FOR THE FIRST HEALTH CHECK (the groups are checked in order):
+    upstream_group_t* dead = find_upstream(data->upstream,"dead.test");
+    for(int i = 0 ; i < 300 && is_healthy(dead,&(dead->backends[0])) ; i++)
+        usleep(10000);
+    usleep(100000); //the rest of the groups.
+    test_health_check(health);
+    test_no_backend();
+    test_ejection(find_upstream(data->upstream,"eject.test"));
+    test_ewma();
+    test_no_response(find_upstream(data->upstream,"drop.test"));
+    destroy_upstreams(data->upstream);
+    free(data);
+    printf("test_upstream: %s\n",failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
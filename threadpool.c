@@ -41,22 +41,23 @@ threadpool* create_threadpool(int num_threads_in_pool)
     return tp;
 }
 
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
+int dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
 {
     if(from_me == NULL) //case of invalid argument
-        return;
+        return -1;
     pthread_mutex_lock(&(from_me->qlock)); //take over control of the threadpool
     if(from_me->dont_accept)    //case destroying the threadpool has already begun.
     {
         pthread_mutex_unlock(&(from_me->qlock));
-        return;
+        return -1;
     }
     //INIT AND ENQUEUE WORK STRUCTURE:
     work_t* work = (work_t*)malloc(sizeof(work_t));
     if(work == NULL)
     {
         perror("MALLOC FAILED");
-        return;
+        pthread_mutex_unlock(&(from_me->qlock));
+        return -1;
     }
     work->routine = dispatch_to_here;
     work->arg = arg;
@@ -70,6 +71,7 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
     
     pthread_cond_signal(&(from_me->q_not_empty));   //signal to one of the threads (start work function) 
     pthread_mutex_unlock(&(from_me->qlock));
+    return 0;
 }
 
 void* do_work(void* p)
@@ -102,17 +104,21 @@ void* do_work(void* p)
             work_t* work = tp->qhead;
             (tp->qsize)--;
             if(work == NULL)
+            {
+                pthread_mutex_unlock(&(tp->qlock));
                 return NULL;
+            }
             tp->qhead = tp->qhead->next;
             if(work->routine == NULL)
             {
                 free(work);
+                pthread_mutex_unlock(&(tp->qlock));
                 return NULL;
             }
             pthread_mutex_unlock(&(tp->qlock));
             work->routine(work->arg);
-            pthread_mutex_lock(&(tp->qlock));
             free(work);    
+            pthread_mutex_lock(&(tp->qlock));
         }
         if(tp->qsize == 0)  //alert queue is empty
             pthread_cond_signal(&(tp->q_empty)); 
@@ -129,7 +135,7 @@ void destroy_threadpool(threadpool* destroyme)
     }
     pthread_mutex_lock(&(destroyme->qlock));    //take over control of the threadpool
     destroyme->dont_accept = 1; //alert dispatch function to not accept anymore work
-    if((destroyme->qsize) > 0)  //case there are still work in the queue.
+    while((destroyme->qsize) > 0)  //case there are still work in the queue.
     {
         pthread_cond_wait(&(destroyme->q_empty),&(destroyme->qlock));   //wait for the work to be done.
     }
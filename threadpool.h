@@ -69,8 +69,10 @@ threadpool* create_threadpool(int num_threads_in_pool);
  * 3. add the work_t element to the queue
  * 4. unlock mutex
  *
+ * it returns 0 if the job was queued, from then "arg" belongs to the job.
+ * it returns -1 if the job was not queued, and the caller still owns "arg".
  */
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+int dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
 /**
  * The work function of the thread
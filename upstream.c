@@ -0,0 +1,377 @@
+#include "upstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+//the next function returns the monotonic time in microseconds.
+static int64_t now_usec(void);
+
+//the next function gets a line of the upstreams file and fills the group, (used in create_upstreams).
+//returns 0 on success, 1 if the line is empty or a comment and -1 if it is invalid.
+static int parse_group(char* line, upstream_group_t* group);
+
+//the next function gets "<host>:<port>" and fills the backend, returns 0 on success and -1 on failure.
+static int parse_backend(char* str, backend_t* backend);
+
+//the next function sends a request to the backend and returns 1 if it answered with a status below 500.
+static int check_backend(const struct sockaddr_in* addr, const char* host);
+
+//the next function frees the fields of the groups (not the array itself).
+static void destroy_groups(upstream_group_t* groups, int num_groups);
+
+
+upstreams* create_upstreams(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+    {
+        perror("FAILED READ FROM UPSTREAMS FILE");
+        return NULL;
+    }
+    upstreams* ups = (upstreams*)malloc(sizeof(upstreams));
+    if(ups == NULL)
+    {
+        perror("MALLOC FAILED");
+        fclose(file);
+        return NULL;
+    }
+    //INIT UPSTREAMS:
+    ups->groups = NULL;
+    ups->num_groups = 0;
+    ups->shutdown = 0;
+    size_t len = 0;
+    char *line = NULL;
+    int line_number = 0;
+    while(getline(&line, &len, file) != -1) //each line of the file is a group.
+    {
+        line_number++;
+        upstream_group_t group;
+        int rc = parse_group(line,&group);
+        if(rc == 1) //case of empty line or comment.
+            continue;
+        if(rc < 0)
+        {
+            printf("INVALID UPSTREAMS FILE (line %d).\n",line_number);
+            free(line);
+            fclose(file);
+            for(int i = 0 ; i < ups->num_groups ; i++)
+                pthread_mutex_destroy(&(ups->groups[i].lock));
+            destroy_groups(ups->groups,ups->num_groups);
+            free(ups->groups);
+            free(ups);
+            return NULL;
+        }
+        upstream_group_t* groups = (upstream_group_t*)realloc(ups->groups,(ups->num_groups+1)*sizeof(upstream_group_t));
+        if(groups == NULL)
+        {
+            perror("MALLOC FAILED");
+            exit(1);
+        }
+        ups->groups = groups;
+        ups->groups[ups->num_groups] = group;
+        pthread_mutex_init(&(ups->groups[ups->num_groups].lock), NULL);
+        (ups->num_groups)++;
+    }
+    free(line);
+    fclose(file);
+    pthread_mutex_init(&(ups->lock), NULL);
+    pthread_cond_init(&(ups->wake), NULL);
+    //CREATING THE HEALTH CHECK THREAD:
+    if(pthread_create(&(ups->checker),NULL,upstream_check,ups) != 0)
+    {
+        perror("pthread_create");
+        for(int i = 0 ; i < ups->num_groups ; i++)
+            pthread_mutex_destroy(&(ups->groups[i].lock));
+        destroy_groups(ups->groups,ups->num_groups);
+        free(ups->groups);
+        pthread_mutex_destroy(&(ups->lock));
+        pthread_cond_destroy(&(ups->wake));
+        free(ups);
+        return NULL;
+    }
+    return ups;
+}
+
+upstream_group_t* find_upstream(upstreams* from_me, const char* host)
+{
+    if(from_me == NULL || host == NULL) //case of invalid argument
+        return NULL;
+    for(int i = 0 ; i < from_me->num_groups ; i++)
+        if(strcasecmp(from_me->groups[i].host,host) == 0)
+            return &(from_me->groups[i]);
+    return NULL;
+}
+
+backend_t* pick_backend(upstream_group_t* group)
+{
+    if(group == NULL) //case of invalid argument
+        return NULL;
+    int64_t now = now_usec();
+    backend_t* best = NULL;
+    int64_t best_score = 0;
+    pthread_mutex_lock(&(group->lock));
+    for(int k = 0 ; k < group->num_backends ; k++) //start from "next" so ties are spread.
+    {
+        backend_t* backend = &(group->backends[(group->next + k) % group->num_backends]);
+        if(!backend->healthy)   //case the backend failed the last health check.
+            continue;
+        if(backend->ejected_until != 0)
+        {
+            if(backend->ejected_until > now)    //case the backend is still ejected.
+                continue;
+            backend->ejected_until = 0; //ejection is over, give it another chance.
+            backend->failures = 0;
+        }
+        int64_t score;
+        if(group->policy == UPSTREAM_LEAST_OUTSTANDING)
+            score = backend->outstanding;
+        else    //expected latency if the request waits behind the outstanding ones.
+            score = (backend->ewma_usec + 1) * (backend->outstanding + 1);
+        if(best == NULL || score < best_score)
+        {
+            best = backend;
+            best_score = score;
+        }
+    }
+    if(best != NULL)
+        (best->outstanding)++;
+    group->next = (group->next + 1) % group->num_backends;
+    pthread_mutex_unlock(&(group->lock));
+    return best;
+}
+
+void backend_done(upstream_group_t* group, backend_t* backend, int ok, int64_t latency_usec)
+{
+    if(group == NULL || backend == NULL) //case of invalid argument
+        return;
+    pthread_mutex_lock(&(group->lock));
+    (backend->outstanding)--;
+    if(!ok) //case connect failed or no response, eject the backend after too many failures.
+    {
+        (backend->failures)++;
+        if(backend->failures >= UPSTREAM_EJECT_FAILURES)
+        {
+            backend->ejected_until = now_usec() + UPSTREAM_EJECT_USEC;
+            backend->failures = 0;
+        }
+    }
+    else
+    {
+        backend->failures = 0;
+        if(backend->ewma_usec == 0) //first sample.
+            backend->ewma_usec = latency_usec;
+        else
+            backend->ewma_usec += (latency_usec - backend->ewma_usec) * UPSTREAM_EWMA_WEIGHT / 100;
+    }
+    pthread_mutex_unlock(&(group->lock));
+}
+
+void* upstream_check(void* p)
+{
+    if(p == NULL)   //case of invalid argument
+    {
+        printf("invalid argument");
+        return NULL;
+    }
+    upstreams* ups = (upstreams*)p;
+    while(1)
+    {
+        for(int i = 0 ; i < ups->num_groups ; i++) //check every backend (the addresses never change).
+        {
+            upstream_group_t* group = &(ups->groups[i]);
+            for(int j = 0 ; j < group->num_backends ; j++)
+            {
+                int healthy = check_backend(&(group->backends[j].addr),group->host);
+                pthread_mutex_lock(&(group->lock));
+                group->backends[j].healthy = healthy;
+                pthread_mutex_unlock(&(group->lock));
+            }
+        }
+        //WAIT FOR THE NEXT CHECK:
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME,&until);
+        until.tv_sec += UPSTREAM_CHECK_USEC / 1000000;
+        until.tv_nsec += (UPSTREAM_CHECK_USEC % 1000000) * 1000;
+        if(until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&(ups->lock));
+        while(!ups->shutdown)
+            if(pthread_cond_timedwait(&(ups->wake),&(ups->lock),&until) != 0)  //case timed out.
+                break;
+        int shutdown = ups->shutdown;
+        pthread_mutex_unlock(&(ups->lock));
+        if(shutdown)
+            return NULL;
+    }
+}
+
+void destroy_upstreams(upstreams* destroyme)
+{
+    if(destroyme == NULL)   //case of invalid argument
+    {
+        printf("invalid argument");
+        return;
+    }
+    pthread_mutex_lock(&(destroyme->lock));
+    destroyme->shutdown = 1;    //alert the checker to finish.
+    pthread_cond_signal(&(destroyme->wake));
+    pthread_mutex_unlock(&(destroyme->lock));
+    void* retval;
+    pthread_join(destroyme->checker,&retval);
+    //DEALLOCATING UPSTREAMS:
+    for(int i = 0 ; i < destroyme->num_groups ; i++)
+        pthread_mutex_destroy(&(destroyme->groups[i].lock));
+    destroy_groups(destroyme->groups,destroyme->num_groups);
+    free(destroyme->groups);
+    pthread_mutex_destroy(&(destroyme->lock));
+    pthread_cond_destroy(&(destroyme->wake));
+    free(destroyme);
+}
+
+static int64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int parse_group(char* line, upstream_group_t* group)
+{
+    char* save = NULL;
+    char* host = strtok_r(line," \t\r\n",&save);
+    if(host == NULL || host[0] == '#') //case of empty line or comment.
+        return 1;
+    char* policy = strtok_r(NULL," \t\r\n",&save);
+    if(policy == NULL)
+        return -1;
+    memset(group,0,sizeof(upstream_group_t));
+    if(strcmp(policy,"least") == 0)
+        group->policy = UPSTREAM_LEAST_OUTSTANDING;
+    else if(strcmp(policy,"ewma") == 0)
+        group->policy = UPSTREAM_EWMA_LATENCY;
+    else
+        return -1;
+    group->host = strdup(host);
+    if(group->host == NULL)
+    {
+        perror("MALLOC FAILED");
+        exit(1);
+    }
+    char* str = strtok_r(NULL," \t\r\n",&save);
+    while(str != NULL)  //the rest of the words are the backends.
+    {
+        backend_t* backends = (backend_t*)realloc(group->backends,(group->num_backends+1)*sizeof(backend_t));
+        if(backends == NULL)
+        {
+            perror("MALLOC FAILED");
+            exit(1);
+        }
+        group->backends = backends;
+        if(parse_backend(str,&(group->backends[group->num_backends])) < 0)
+        {
+            destroy_groups(group,1);
+            return -1;
+        }
+        (group->num_backends)++;
+        str = strtok_r(NULL," \t\r\n",&save);
+    }
+    if(group->num_backends == 0)    //case of group without backends.
+    {
+        destroy_groups(group,1);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_backend(char* str, backend_t* backend)
+{
+    memset(backend,0,sizeof(backend_t));
+    char* port_ptr = strrchr(str,':');
+    if(port_ptr == NULL || atoi(port_ptr+1) <= 0)    //case there is no port.
+        return -1;
+    backend->name = strdup(str);
+    if(backend->name == NULL)
+    {
+        perror("MALLOC FAILED");
+        exit(1);
+    }
+    *port_ptr = '\0';
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(str,NULL,&hints,&res) != 0)  //case the backend host does not exist.
+    {
+        printf("UNKNOWN BACKEND %s.\n",backend->name);
+        free(backend->name);
+        backend->name = NULL;
+        return -1;
+    }
+    backend->addr.sin_family = AF_INET;
+    backend->addr.sin_addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+    backend->addr.sin_port = htons(atoi(port_ptr+1));
+    freeaddrinfo(res);
+    backend->healthy = 1;   //healthy until the first check says otherwise.
+    return 0;
+}
+
+static int check_backend(const struct sockaddr_in* addr, const char* host)
+{
+    int sd = socket(AF_INET , SOCK_STREAM , 0);
+    if(sd < 0)
+        return 0;
+    struct timeval timeout;
+    timeout.tv_sec = UPSTREAM_CHECK_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(sd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout)); //also limits connect.
+    setsockopt(sd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+    if(connect(sd,(const struct sockaddr*)addr,sizeof(*addr)) < 0)
+    {
+        close(sd);
+        return 0;
+    }
+    char request[300];
+    snprintf(request,sizeof(request),"GET / HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",host);
+    if(write(sd,request,strlen(request)) < 0)
+    {
+        close(sd);
+        return 0;
+    }
+    char buffer[32];
+    memset(buffer,'\0',sizeof(buffer));
+    int size = 0;
+    while(size < 12)    //read the status line ("HTTP/1.x NNN").
+    {
+        int rc = read(sd,buffer+size,sizeof(buffer)-1-size);
+        if(rc <= 0)
+            break;
+        size += rc;
+    }
+    close(sd);
+    if(size < 12 || strncmp(buffer,"HTTP/",5) != 0)
+        return 0;
+    int status = atoi(buffer+9);
+    return status > 0 && status < 500;
+}
+
+static void destroy_groups(upstream_group_t* groups, int num_groups)
+{
+    for(int i = 0 ; i < num_groups ; i++)
+    {
+        for(int j = 0 ; j < groups[i].num_backends ; j++)
+            free(groups[i].backends[j].name);
+        free(groups[i].backends);
+        free(groups[i].host);
+    }
+}
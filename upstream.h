@@ -0,0 +1,117 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * upstream.h
+ *
+ * This file declares the upstream groups of the proxy server.
+ * a group maps a virtual host to a pool of backend servers, so requests
+ * to that host are balanced between the backends instead of dialing the host.
+ * a background thread checks the backends (active health check), and backends
+ * which fail to connect too many times in a row are ejected for a while (passive).
+ *
+ * the upstreams file holds a group in each line:
+ *     <virtual-host> <least|ewma> <backend-host>:<port> [<backend-host>:<port> ...]
+ * empty lines and lines starting with '#' are ignored.
+ */
+
+// time between two active health checks of the backends
+#define UPSTREAM_CHECK_USEC 2000000
+// timeout of connecting / reading a backend during a health check
+#define UPSTREAM_CHECK_TIMEOUT_SEC 1
+// timeout of connecting a backend for a request, so a blackholed backend is ejected quickly
+#define UPSTREAM_CONNECT_TIMEOUT_SEC 2
+// consecutive connect failures that eject a backend
+#define UPSTREAM_EJECT_FAILURES 3
+// how long an ejected backend is kept out of the choice
+#define UPSTREAM_EJECT_USEC 10000000
+// weight of a new latency sample in the ewma (percent)
+#define UPSTREAM_EWMA_WEIGHT 30
+
+#define UPSTREAM_LEAST_OUTSTANDING 0
+#define UPSTREAM_EWMA_LATENCY 1
+
+
+/**
+ * a single backend server of a group, guarded by the lock of it's group
+ */
+typedef struct backend_st{
+      char* name;                  //"<host>:<port>" as written in the file
+      struct sockaddr_in addr;     //resolved address of the backend
+      int outstanding;             //requests currently sent to the backend
+      int64_t ewma_usec;           //ewma of the latency (connect to first byte), 0 if unknown
+      int healthy;                 //result of the last active health check
+      int failures;                //consecutive connect failures
+      int64_t ejected_until;       //monotonic time the ejection ends, 0 if not ejected
+} backend_t;
+
+
+/**
+ * a virtual host and it's backends
+ */
+typedef struct upstream_group_st{
+      char* host;                  //the virtual host
+      int policy;                  //UPSTREAM_LEAST_OUTSTANDING or UPSTREAM_EWMA_LATENCY
+      backend_t* backends;         //array of backends
+      int num_backends;
+      int next;                    //where to start the next choice (spreads ties)
+      pthread_mutex_t lock;        //lock on the backends
+} upstream_group_t;
+
+
+/**
+ * The actual upstreams
+ */
+typedef struct _upstreams_st {
+      upstream_group_t* groups;    //array of groups
+      int num_groups;
+      pthread_t checker;           //the health check thread
+      pthread_mutex_t lock;        //lock on shutdown
+      pthread_cond_t wake;         //wakes the checker on shutdown
+      int shutdown;                //1 if the upstreams are in distruction process
+} upstreams;
+
+
+/**
+ * create_upstreams reads the upstreams file at "path", resolves the backends
+ * and starts the health check thread. If the function succeeds, it returns
+ * a (non-NULL) "upstreams", else it prints the problem and returns NULL.
+ */
+upstreams* create_upstreams(const char* path);
+
+/**
+ * find_upstream returns the group of the virtual host "host", or NULL
+ * if the host is not configured (and should be dialed directly).
+ */
+upstream_group_t* find_upstream(upstreams* from_me, const char* host);
+
+/**
+ * pick_backend chooses a backend of the group by it's policy, skipping
+ * backends which failed the health check or are ejected, and counts
+ * the request as outstanding on it.
+ * it returns NULL if no backend is available.
+ */
+backend_t* pick_backend(upstream_group_t* group);
+
+/**
+ * backend_done ends a request which was sent to "backend".
+ * "ok" is 0 if connecting the backend failed or it closed without a response,
+ * else "latency_usec" (connect to first byte) is added to the ewma of the backend.
+ */
+void backend_done(upstream_group_t* group, backend_t* backend, int ok, int64_t latency_usec);
+
+/**
+ * The work function of the health check thread
+ * this function should:
+ * 1. send a request to every backend
+ * 2. mark the backend healthy if it answered with a status below 500
+ * 3. wait UPSTREAM_CHECK_USEC or until shutdown
+ */
+void* upstream_check(void* p);
+
+/**
+ * destroy_upstreams stops the health check thread and
+ * frees all the memory associated with the upstreams.
+ */
+void destroy_upstreams(upstreams* destroyme);